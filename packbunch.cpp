@@ -6,6 +6,13 @@
 #include <cstdio>
 #include <cctype>
 #include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <system_error>
+#include <unistd.h>
 
 namespace pb
 {
@@ -14,7 +21,18 @@ namespace pb
 
     constexpr char VERSION[] = "1.0";
 
+    constexpr char DPKG_STATUS[] = "/var/lib/dpkg/status";
+    constexpr char DPKG_INFO[] = "/var/lib/dpkg/info/";
+
     std::string path;
+    std::string cache_path;
+
+    struct package_usage
+    {
+        bool installed = false;
+        std::uintmax_t installed_kib = 0;
+        std::uintmax_t file_bytes = 0;
+    };
 
     void help();
     void list();
@@ -27,6 +45,16 @@ namespace pb
     int uninstall_bunch(const std::string& bunch_name);
     int import_bunch(const std::string& bunch_path);
     int export_bunch(const std::string& bunch_name, const std::string& export_path);
+    int usage(const std::vector<std::string>& bunch_names);
+
+    int read_bunch(const std::string& bunch_name, std::vector<std::string>& packages);
+    std::string dpkg_status_stamp();
+    std::map<std::string, std::uintmax_t> read_dpkg_status();
+    std::map<std::string, std::vector<std::string>> read_dpkg_lists();
+    package_usage measure_package(const std::string& package_name, const std::map<std::string, std::uintmax_t>& installed_sizes, const std::map<std::string, std::vector<std::string>>& list_files);
+    void load_usage_cache(const std::string& stamp, std::map<std::string, package_usage>& cache);
+    void save_usage_cache(const std::string& stamp, const std::map<std::string, package_usage>& cache);
+    std::string format_size(std::uintmax_t bytes);
 
     bool valid_bunch_name(const std::string& name);
     bool valid_package_name(const std::string& name);
@@ -38,6 +66,7 @@ int main(int argc, const char* argv[])
     if (sudo)
     {
         pb::path = "/home/" + std::string (sudo) + "/.packbunch/bunches/";
+        pb::cache_path = "/home/" + std::string (sudo) + "/.packbunch/usage_cache";
     }
     else
     {
@@ -48,6 +77,7 @@ int main(int argc, const char* argv[])
             return pb::FAILURE;
         }
         pb::path = std::string {home_path} + "/.packbunch/bunches/";
+        pb::cache_path = std::string {home_path} + "/.packbunch/usage_cache";
     }
     std::filesystem::path fs_path {pb::path};
     if (!std::filesystem::exists(fs_path))
@@ -221,6 +251,13 @@ int main(int argc, const char* argv[])
         std::string export_path {argv[3]};
         return pb::export_bunch(bunch_name, export_path);
     }
+    if (command_name == "usage")
+    {
+        std::vector<std::string> bunch_names {};
+        for (int i = 2; i < argc; i++)
+            bunch_names.emplace_back(std::string {argv[i]});
+        return pb::usage(bunch_names);
+    }
 
     std::cerr << "Command \"" << command_name << "\" doesn't exist. Use \"packbunch help\" to see all available commands.\n";
     return pb::FAILURE;
@@ -242,6 +279,7 @@ void pb::help()
     "  packbunch uninstall <bunch>            Uninstalls all packages in bunch.\n"
     "  packbunch import <path>                Copies bunch from path into bunch directory.\n"
     "  packbunch export <bunch> <path>        Copies bunch to specified path (must be a directory).\n"
+    "  packbunch usage [bunch]...             Shows how much disk space bunches use (all bunches if none given).\n"
     ;
 }
 
@@ -616,6 +654,334 @@ int pb::export_bunch(const std::string& bunch_name, const std::string& export_pa
     }
 }
 
+int pb::usage(const std::vector<std::string>& bunch_names)
+{
+    // All bunches are read, not just the requested ones, so we know which packages are shared
+    std::map<std::string, std::vector<std::string>> bunches {};
+    std::vector<std::string> unreadable {};
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator {pb::path})
+    {
+        std::string bunch_name {file.path().filename().string()};
+        if (!pb::valid_bunch_name(bunch_name))
+            continue;
+        std::vector<std::string> packages {};
+        if (pb::read_bunch(bunch_name, packages) == pb::FAILURE)
+        {
+            std::cerr << "Skipping bunch \"" << bunch_name << "\", packages it shares with other bunches won't be counted as shared.\n";
+            unreadable.emplace_back(bunch_name);
+            continue;
+        }
+        bunches[bunch_name] = packages;
+    }
+
+    std::vector<std::string> targets {bunch_names};
+    if (targets.empty())
+    {
+        for (const auto& [bunch_name, packages] : bunches)
+            targets.emplace_back(bunch_name);
+    }
+    for (const std::string& bunch_name : targets)
+    {
+        if (!pb::valid_bunch_name(bunch_name))
+        {
+            std::cerr << "Bunch name \"" << bunch_name << "\" is invalid. It can only contain letters, digits, and the following characters: \"_\", \"-\", \".\".\n";
+            return pb::FAILURE;
+        }
+        if (bunches.find(bunch_name) == bunches.end())
+        {
+            // Bunches that exist but couldn't be read were already reported above
+            if (std::find(unreadable.begin(), unreadable.end(), bunch_name) == unreadable.end())
+                std::cerr << "Bunch \"" << bunch_name << "\" doesn't exist.\n";
+            return pb::FAILURE;
+        }
+    }
+
+    std::map<std::string, int> owners {};
+    for (const auto& [bunch_name, packages] : bunches)
+    {
+        for (const std::string& package : packages)
+            owners[package]++;
+    }
+
+    std::string stamp {pb::dpkg_status_stamp()};
+    if (stamp.empty())
+    {
+        std::cerr << "Couldn't read \"" << pb::DPKG_STATUS << "\".\n";
+        return pb::FAILURE;
+    }
+    std::map<std::string, package_usage> cache {};
+    pb::load_usage_cache(stamp, cache);
+
+    // Packages missing from the cache are measured once each, spread across threads package by package
+    std::vector<std::string> pending {};
+    {
+        std::map<std::string, bool> queued {};
+        for (const std::string& bunch_name : targets)
+        {
+            for (const std::string& package : bunches[bunch_name])
+            {
+                if (cache.find(package) == cache.end() && !queued[package])
+                {
+                    queued[package] = true;
+                    pending.emplace_back(package);
+                }
+            }
+        }
+    }
+    if (!pending.empty())
+    {
+        std::map<std::string, std::uintmax_t> installed_sizes {pb::read_dpkg_status()};
+        std::map<std::string, std::vector<std::string>> list_files {pb::read_dpkg_lists()};
+
+        std::vector<package_usage> results (pending.size());
+        std::atomic<std::size_t> next {0};
+        auto worker = [&]()
+        {
+            for (std::size_t i = next++; i < pending.size(); i = next++)
+                results[i] = pb::measure_package(pending[i], installed_sizes, list_files);
+        };
+        std::size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+        thread_count = std::min(thread_count, pending.size());
+        std::vector<std::thread> threads {};
+        for (std::size_t i = 0; i < thread_count; i++)
+            threads.emplace_back(worker);
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (std::size_t i = 0; i < pending.size(); i++)
+            cache[pending[i]] = results[i];
+        pb::save_usage_cache(stamp, cache);
+    }
+
+    for (const std::string& bunch_name : targets)
+    {
+        std::uintmax_t installed_kib = 0, shared_kib = 0;
+        std::uintmax_t file_bytes = 0, shared_bytes = 0;
+        int installed_count = 0, shared_count = 0, missing_count = 0;
+        for (const std::string& package : bunches[bunch_name])
+        {
+            const package_usage& usage = cache[package];
+            if (!usage.installed)
+            {
+                missing_count++;
+                continue;
+            }
+            installed_count++;
+            installed_kib += usage.installed_kib;
+            file_bytes += usage.file_bytes;
+            if (owners[package] > 1)
+            {
+                shared_count++;
+                shared_kib += usage.installed_kib;
+                shared_bytes += usage.file_bytes;
+            }
+        }
+
+        std::cout << "Bunch \"" << bunch_name << "\":\n"
+                  << "  Installed-Size: " << pb::format_size(installed_kib * 1024)
+                  << " (" << pb::format_size((installed_kib - shared_kib) * 1024) << " exclusive, "
+                  << pb::format_size(shared_kib * 1024) << " shared with other bunches)\n"
+                  << "  File size:      " << pb::format_size(file_bytes)
+                  << " (" << pb::format_size(file_bytes - shared_bytes) << " exclusive, "
+                  << pb::format_size(shared_bytes) << " shared with other bunches)\n"
+                  << "  Packages:       " << installed_count << " installed (" << shared_count << " shared), "
+                  << missing_count << " not installed\n";
+    }
+    std::cout << "\"packbunch uninstall\" removes every package in a bunch, including shared ones, so it frees about the full total.\n"
+                 "Only the exclusive part can be freed without affecting other bunches.\n";
+    return pb::SUCCESS;
+}
+
+int pb::read_bunch(const std::string& bunch_name, std::vector<std::string>& packages)
+{
+    std::ifstream file {pb::path + bunch_name};
+    if (!file)
+    {
+        std::cerr << "Couldn't open bunch \"" << bunch_name << "\".\n";
+        return pb::FAILURE;
+    }
+    std::string package {};
+    while (file >> package)
+    {
+        if (pb::valid_package_name(package) && std::find(packages.begin(), packages.end(), package) == packages.end())
+            packages.emplace_back(package);
+    }
+    return pb::SUCCESS;
+}
+
+std::string pb::dpkg_status_stamp()
+{
+    // dpkg rewrites its status file whenever a package is installed or removed
+    std::error_code error {};
+    std::filesystem::file_time_type time = std::filesystem::last_write_time(pb::DPKG_STATUS, error);
+    if (error)
+        return "";
+    std::uintmax_t size = std::filesystem::file_size(pb::DPKG_STATUS, error);
+    if (error)
+        return "";
+    return std::to_string(time.time_since_epoch().count()) + ' ' + std::to_string(size);
+}
+
+std::map<std::string, std::uintmax_t> pb::read_dpkg_status()
+{
+    std::map<std::string, std::uintmax_t> installed_sizes {};
+    std::ifstream file {pb::DPKG_STATUS};
+    std::string line {}, package {};
+    std::uintmax_t size = 0;
+    bool installed = false;
+    // An empty line ends a package's entry, including the last one
+    while (true)
+    {
+        bool more = static_cast<bool>(std::getline(file, line));
+        if (!more || line.empty())
+        {
+            if (installed && !package.empty())
+                installed_sizes[package] += size; // Multi-arch packages have one entry per architecture
+            package.clear();
+            size = 0;
+            installed = false;
+            if (!more)
+                break;
+        }
+        else if (line.rfind("Package: ", 0) == 0)
+        {
+            package = line.substr(9);
+        }
+        else if (line.rfind("Status: ", 0) == 0)
+        {
+            installed = line.size() >= 10 && line.compare(line.size() - 10, 10, " installed") == 0;
+        }
+        else if (line.rfind("Installed-Size: ", 0) == 0)
+        {
+            size = std::strtoull(line.c_str() + 16, nullptr, 10);
+        }
+    }
+    return installed_sizes;
+}
+
+std::map<std::string, std::vector<std::string>> pb::read_dpkg_lists()
+{
+    std::map<std::string, std::vector<std::string>> list_files {};
+    std::error_code error {};
+    for (const std::filesystem::directory_entry& file : std::filesystem::directory_iterator {pb::DPKG_INFO, error})
+    {
+        std::string name {file.path().filename().string()};
+        if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".list") != 0)
+            continue;
+        name.erase(name.size() - 5);
+        name = name.substr(0, name.find(':')); // Strip the architecture, e.g. "libc6:amd64"
+        list_files[name].emplace_back(file.path().string());
+    }
+    return list_files;
+}
+
+pb::package_usage pb::measure_package(const std::string& package_name, const std::map<std::string, std::uintmax_t>& installed_sizes, const std::map<std::string, std::vector<std::string>>& list_files)
+{
+    package_usage usage {};
+    auto installed = installed_sizes.find(package_name);
+    if (installed == installed_sizes.end())
+        return usage;
+    usage.installed = true;
+    usage.installed_kib = installed->second;
+
+    auto lists = list_files.find(package_name);
+    if (lists == list_files.end())
+        return usage;
+    // Multi-Arch: same packages list the same shared files once per architecture
+    std::map<std::string, bool> counted {};
+    for (const std::string& list : lists->second)
+    {
+        std::ifstream file {list};
+        std::string line {};
+        while (std::getline(file, line))
+        {
+            if (counted[line])
+                continue;
+            counted[line] = true;
+            // Directories are shared between packages and symlinks take no real space, so only regular files count
+            std::error_code error {};
+            std::filesystem::file_status status = std::filesystem::symlink_status(line, error);
+            if (error || !std::filesystem::is_regular_file(status))
+                continue;
+            std::uintmax_t size = std::filesystem::file_size(line, error);
+            if (!error)
+                usage.file_bytes += size;
+        }
+    }
+    return usage;
+}
+
+void pb::load_usage_cache(const std::string& stamp, std::map<std::string, package_usage>& cache)
+{
+    std::ifstream file {pb::cache_path};
+    std::string line {};
+    if (!std::getline(file, line) || line != stamp)
+        return;
+    std::string package {};
+    package_usage usage {};
+    while (file >> package >> usage.installed >> usage.installed_kib >> usage.file_bytes)
+        cache[package] = usage;
+}
+
+void pb::save_usage_cache(const std::string& stamp, const std::map<std::string, package_usage>& cache)
+{
+    // The cache is written to a temporary file and renamed over the old one, so a concurrent run never reads it half-written
+    std::string temp_path {pb::cache_path + '.' + std::to_string(getpid())};
+    {
+        std::ofstream file {temp_path};
+        if (!file)
+        {
+            std::cerr << "Couldn't save usage cache to \"" << pb::cache_path << "\".\n";
+            return;
+        }
+        file << stamp << '\n';
+        for (const auto& [package, usage] : cache)
+            file << package << ' ' << usage.installed << ' ' << usage.installed_kib << ' ' << usage.file_bytes << '\n';
+        file.close();
+        if (!file)
+        {
+            std::remove(temp_path.c_str());
+            std::cerr << "Couldn't save usage cache to \"" << pb::cache_path << "\".\n";
+            return;
+        }
+    }
+
+    // Under sudo the cache belongs to the user who ran it, otherwise later runs without sudo couldn't update it
+    if (std::getenv("SUDO_USER"))
+    {
+        char *uid = std::getenv("SUDO_UID");
+        char *gid = std::getenv("SUDO_GID");
+        if (!uid || !gid || chown(temp_path.c_str(), static_cast<uid_t>(std::strtoul(uid, nullptr, 10)), static_cast<gid_t>(std::strtoul(gid, nullptr, 10))) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    std::error_code error {};
+    std::filesystem::rename(temp_path, pb::cache_path, error);
+    if (error)
+    {
+        std::remove(temp_path.c_str());
+        std::cerr << "Couldn't save usage cache to \"" << pb::cache_path << "\".\n";
+    }
+}
+
+std::string pb::format_size(std::uintmax_t bytes)
+{
+    constexpr const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double size = static_cast<double>(bytes);
+    int unit = 0;
+    while (size >= 1024 && unit < 4)
+    {
+        size /= 1024;
+        unit++;
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f %s" : "%.1f %s", size, units[unit]);
+    return std::string {buffer};
+}
+
 bool pb::valid_bunch_name(const std::string& name)
 {
     bool valid = true;